@@ -0,0 +1,51 @@
+#!/bin/bash
+# Compare the plain trace loop against the batched loop (-B) on a data cache
+# much larger than the host's last level cache. The batched runs are done
+# twice: with the set prefetches, and with a build where they are compiled
+# out (-DNO_SET_PREFETCH), so the gain from batching alone is visible.
+#
+# Usage: ./bench_batch.sh [records]
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RECORDS=${1:-4000000}
+TMP=${TMPDIR:-/tmp}
+TRACE=$TMP/cachesim_bench_trace_$RECORDS.txt
+SIM=$TMP/cachesim_bench
+SIM_NOPF=$TMP/cachesim_bench_nopf
+# 16M blocks * 16 bytes of metadata = 256 MB of simulated sets.
+CONFIG="-I 1024:4:2:L -D 1:16777216:1:1:R:B:A"
+
+$CC $CFLAGS -o "$SIM" "$DIR/cachesim.c" -lm || exit 1
+$CC $CFLAGS -DNO_SET_PREFETCH -o "$SIM_NOPF" "$DIR/cachesim.c" -lm || exit 1
+
+if [ ! -f "$TRACE" ]; then
+	awk -v n="$RECORDS" 'BEGIN {
+		srand(1541);
+		for(i = 0; i < n; i++)
+		{
+			r = rand();
+			if(r < 0.2)
+				printf("0x%08x I\n", 4194304 + (i % 4096) * 4);
+			else if(r < 0.8)
+				printf("0x%08x R\n", int(rand() * 1073741824) * 4);
+			else
+				printf("0x%08x W\n", int(rand() * 1073741824) * 4);
+		}
+	}' > "$TRACE"
+fi
+
+TIMEFORMAT="%R s"
+run()
+{
+	echo "== $1 $2"
+	time "$1" -F -S $2 $CONFIG "$TRACE" > /dev/null
+	"$1" -F -S $2 $CONFIG "$TRACE" | md5sum
+}
+
+run "$SIM" ""
+for flags in "-B 16" "-B 64"; do
+	run "$SIM_NOPF" "$flags"
+	run "$SIM" "$flags"
+done
@@ -4,6 +4,8 @@
 #include "cachesim.h"
 #include <math.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
 Usage:
@@ -34,11 +36,69 @@ The seventh item is the allocation scheme and can be:
 	A for write-Allocate
 	N for write-No-allocate
 
+Both -I and -D take an optional last item for how addresses pick their set
+(-I 4096:1:2:R:X, -D 1:4096:2:4:R:B:A:X):
+	M for Modulo, the low bits of the block address (the default)
+	X for XOR, the modulo index XORed with the tag folded into chunks of the
+	  same width
+	P for Prime modulo, the block address modulo the largest prime no bigger
+	  than the number of sets; the sets above it go unused
+	S for Skewed associativity, every way hashes the tag differently; needs
+	  associativity of 2 or more
+
 The last argument is the filename of the memory trace to read. This is a text
 file where every line is of the form:
 	0x00000000 R
 A hexadecimal address, followed by a space and then R, W, or I for data read,
 data write, or instruction fetch, respectively.
+
+Results are kept in a local store (.cachesim-results, or the directory named by
+the CACHESIM_RESULTS environment variable) keyed by a fingerprint of the trace
+and the cache parameters. Running the same trace and parameters again prints
+the stored statistics without re-reading the trace. The -F flag forces the
+simulation to run again and refreshes the stored result.
+
+The -S flag allocates cache sets the first time they are touched instead of all
+at once. Results are the same; startup is instant and memory use follows the
+sets the trace actually uses, which matters for very large caches.
+
+The -B flag takes a window size (1 to 256) and runs the trace in batches of
+that many records: the whole batch is parsed, the sets it will touch are
+prefetched, then it is simulated. Results are the same; it helps when the
+simulated cache is larger than the host's caches, partly because the set
+lookups of a batch no longer wait on parsing and partly from the prefetches.
+See bench_batch.sh.
+
+The -P flag attaches a prefetcher to a cache and can be given once per cache:
+	D:S:2:4
+The first item is the cache, I or D. The second is the prefetcher:
+	N for Next-N-line: on a miss or the first use of a prefetched block,
+	  fetch the blocks distance .. distance + degree - 1 ahead.
+	S for Stride: a reference prediction table indexed by the pc (the last
+	  instruction fetch) fetches degree blocks starting distance strides
+	  ahead once it has seen the same stride twice in a row.
+	B for stream Buffers: 4 buffers of degree blocks each, started distance
+	  blocks after a miss. A miss that finds its block in a buffer takes it
+	  from there instead of memory.
+The last two items are the degree and distance. Prefetched words count towards
+the words read and get their own accuracy/coverage stats.
+
+The -W flag adds a write-combining buffer with the given number of entries
+(up to 64) to the L1 D-cache, which must be write-through. Stores to a block
+already in the buffer are merged, and a block's words reach memory only when
+its entry is flushed.
+
+The -V flag adds a fully associative LRU victim cache with the given number of
+entries (up to 64) behind the L1 D-cache. Blocks evicted from L1 go there, and
+a miss that finds its block there gets it back without a memory read. Dirty
+blocks are written back when the victim cache evicts them.
+
+The -H flag takes a filename and writes instrumentation for both caches there
+as CSV: per-set accesses, misses and evictions for every set that was used,
+a histogram of reuse intervals (demand accesses to the cache between two
+touches of a resident block) and one of eviction ages (accesses from fill to
+eviction). Histogram buckets are powers of two. Runs with -H always simulate
+the trace.
 */
 
 /* These global variables will hold the info needed to set up your caches in
@@ -50,8 +110,181 @@ static CacheInfo dcache_info[3];
 //static IMetaData iMeta;
 //static DMetaData dMeta;
 
-static MetaData** iCache;
-static MetaData** dCache;
+//Hardware prefetcher attached to a cache with -P.
+#define RPT_SIZE 64
+#define NUM_STREAMS 4
+
+typedef enum
+{
+	Prefetch_NONE,
+	Prefetch_NEXT_LINE,
+	Prefetch_STRIDE,
+	Prefetch_STREAM
+} PrefetchKind;
+
+//Reference prediction table entry states.
+typedef enum
+{
+	Stride_INITIAL,
+	Stride_TRANSIENT,
+	Stride_STEADY,
+	Stride_NO_PRED
+} StrideState;
+
+typedef struct
+{
+	addr_t pc;
+	addr_t last; //Last block address seen from this pc.
+	long stride;
+	StrideState state;
+} StrideEntry;
+
+//Holds the blocks head .. head + count - 1, already read from memory.
+typedef struct
+{
+	addr_t head;
+	int count;
+	int lastUse;
+} StreamBuffer;
+
+typedef struct
+{
+	PrefetchKind kind;
+	int degree;
+	int distance;
+	StrideEntry rpt[RPT_SIZE];
+	StreamBuffer streams[NUM_STREAMS];
+	int clock;
+	int issued;    //Blocks read from memory by the prefetcher.
+	int useful;    //Prefetched blocks later used by a demand access.
+	int useless;   //Prefetched blocks thrown away before being used.
+	int wordsRead; //Memory traffic added by prefetching.
+} Prefetcher;
+
+//Per-set and per-block instrumentation for -H.
+#define HIST_BUCKETS 32
+
+typedef struct
+{
+	int accesses;
+	int misses;
+	int evictions;
+} SetCounters;
+
+typedef struct
+{
+	unsigned int lastTouch;
+	unsigned int fillTime;
+} BlockTimes;
+
+typedef struct
+{
+	SetCounters** setPages;
+	BlockTimes** timePages;
+	unsigned int clock; //Demand accesses to this cache so far.
+	//Bucket b counts intervals in [2^b, 2^(b+1)) accesses.
+	int reuse[HIST_BUCKETS];       //Between demand touches of a resident block.
+	int evictionAge[HIST_BUCKETS]; //From a block's fill to its eviction.
+} CacheStats;
+
+//How an address picks its set.
+typedef enum
+{
+	Index_MODULO,
+	Index_XOR,
+	Index_PRIME,
+	Index_SKEWED
+} IndexScheme;
+
+//Sets are stored in pages of SET_PAGE_ROWS rows so the table can either be
+//allocated all at once or, with -S, one page at a time as sets are touched.
+#define SET_PAGE_SHIFT 8
+#define SET_PAGE_ROWS (1 << SET_PAGE_SHIFT)
+
+typedef struct
+{
+	MetaData** pages;
+	int numPages;
+	int pageRows;   //Rows in one page.
+	int pageBlocks; //Blocks in one page.
+	int associativity;
+	//Address split, worked out once in setUpTable().
+	int rowShift;
+	int rowMask;
+	int tagShift;
+	int tagMask;
+	//Set indexing, see setIndex().
+	IndexScheme indexing;
+	int xorMask;         //rowMask for XOR folding, 0 otherwise.
+	int foldShift;       //Width of one folded chunk of the tag.
+	int primeSets;       //Sets used by prime modulo indexing, 0 otherwise.
+	unsigned long long primeMagic;
+	int primeShift;
+	int skewShift;
+	int useClock;        //Skewed caches keep use times in LRU instead of ages.
+	//Only set up when the cache has a prefetcher. Holds tag + 1 for blocks
+	//brought in by a prefetch and not used yet, 0 otherwise.
+	Prefetcher* prefetcher;
+	int** pfPages;
+	//Only set up for the D-cache with -V. 1 for blocks that are dirty only
+	//because they came back dirty from the victim cache; without -V they would
+	//have been reloaded clean.
+	int** keptPages;
+	CacheStats* stats; //Only set with -H.
+} SetTable;
+
+static SetTable iCache;
+static SetTable dCache;
+static IndexScheme iIndexing;
+static IndexScheme dIndexing[3];
+int sparseSets;
+static Prefetcher iPrefetch;
+static Prefetcher dPrefetch;
+static CacheStats iStats;
+static CacheStats dStats;
+const char* statsPath; //-H output file.
+addr_t lastFetch; //Most recent instruction fetch, used as the pc for data accesses.
+addr_t storeAddress; //Address of the store dWrite() is handling.
+
+//Write-combining buffer for -W. Write-through stores to the same block are
+//merged and only reach memory when their entry is flushed.
+#define MAX_COMBINE_ENTRIES 64
+
+typedef struct
+{
+	addr_t block;
+	unsigned long long words; //One bit per word written, 0 if the entry is free.
+	int lastUse;
+} CombineEntry;
+
+static CombineEntry combineBuffer[MAX_COMBINE_ENTRIES];
+int combineEntries;
+int combineClock;
+int combineStores;
+int combineHits;
+int combineWords;
+
+//Fully associative victim cache behind the L1 D-cache for -V.
+#define MAX_VICTIM_ENTRIES 64
+
+typedef struct
+{
+	addr_t block;
+	int valid;
+	int dirty;
+	int lastUse;
+} VictimEntry;
+
+static VictimEntry victimCache[MAX_VICTIM_ENTRIES];
+int victimEntries;
+int victimClock;
+int victimReadHits;
+int victimWriteHits;
+int victimReadWords;  //Read miss words served by the victim cache.
+int victimFetchWords; //Write allocate words served by the victim cache.
+//Write-back words a run without -V would have done, less the ones the victim
+//cache did.
+int victimWritebacks;
 int dallocate;
 int wordIndex;
 int numWrites;
@@ -81,7 +314,7 @@ int wHits;
 int wMisses;
 int numWordsRead;
 
-void setUpVariables(MetaData** a, CacheInfo cache_info)
+void setUpVariables()
 {
 	readMisses = 0;
 	readHits = 0;
@@ -97,49 +330,261 @@ void setUpVariables(MetaData** a, CacheInfo cache_info)
 	wHits = 0;
 	wMisses = 0;
 	numWordsRead = 0;
-	int numBlocks = cache_info.num_blocks;
-	int associativity = cache_info.associativity;
-	for(int j = 0; j < (numBlocks/associativity); j++)
+}
+
+//Largest prime no bigger than n, or 1 if there is none.
+int largestPrime(int n)
+{
+	for(; n > 1; n--)
 	{
-		for(int i = 0; i < associativity; i++)
+		int prime = 1;
+		for(int d = 2; d * d <= n && prime; d++)
+			prime = n % d != 0;
+		if(prime)
+			return n;
+	}
+	return 1;
+}
+
+void* callocOrDie(size_t count, size_t size)
+{
+	void* p = calloc(count, size);
+	if(p == NULL)
+	{
+		fprintf(stderr, "Out of memory allocating cache.\n");
+		exit(1);
+	}
+	return p;
+}
+
+//Allocate the page directory for a cache. Blocks come from calloc so they
+//start out invalid and clean. Without -S every page is allocated up front.
+void setUpTable(SetTable* table, CacheInfo cache_info)
+{
+	int numRows = cache_info.num_blocks/cache_info.associativity;
+	table->associativity = cache_info.associativity;
+	table->pageRows = numRows < SET_PAGE_ROWS ? numRows : SET_PAGE_ROWS;
+	table->pageBlocks = table->pageRows * cache_info.associativity;
+	table->numPages = (numRows + SET_PAGE_ROWS - 1) >> SET_PAGE_SHIFT;
+
+	int wordBit = (int) ceil(log2(cache_info.words_per_block));
+	int rowBit = (int) ceil(log2(numRows));
+	int tagBit = 32 - wordBit - rowBit - 2;
+	table->rowShift = wordBit + 2;
+	table->tagShift = wordBit + rowBit + 2;
+	table->rowMask = (1 << rowBit) - 1;
+	table->tagMask = (1 << tagBit) - 1;
+	table->skewShift = rowBit > 0 ? 32 - rowBit : 31;
+	table->foldShift = rowBit;
+	if(table->indexing == Index_XOR)
+		table->xorMask = table->rowMask;
+	if(table->indexing == Index_PRIME && largestPrime(numRows) > 1)
+	{
+		//Divide by multiplying with a rounded up reciprocal. This is exact for
+		//block numbers below 2^30, which covers every 32-bit address.
+		int sets = largestPrime(numRows);
+		int bits = (int) ceil(log2(sets));
+		table->primeSets = sets;
+		table->primeShift = 30 + bits;
+		table->primeMagic = ((1ULL << table->primeShift) + sets - 1) / sets;
+		//The quotient is the tag, see blockTag().
+		table->tagMask = 0;
+	}
+
+	table->pages = callocOrDie(table->numPages, sizeof(MetaData*));
+	if(table->prefetcher != NULL)
+		table->pfPages = callocOrDie(table->numPages, sizeof(int*));
+	if(table == &dCache && victimEntries > 0)
+		table->keptPages = callocOrDie(table->numPages, sizeof(int*));
+	if(table->stats != NULL)
+	{
+		table->stats->setPages = callocOrDie(table->numPages, sizeof(SetCounters*));
+		table->stats->timePages = callocOrDie(table->numPages, sizeof(BlockTimes*));
+	}
+
+	if(sparseSets)
+		return;
+
+	//One allocation per array, split into pages.
+	size_t numBlocks = (size_t)table->numPages * table->pageBlocks;
+	size_t rows = (size_t)table->numPages * table->pageRows;
+	MetaData* blocks = callocOrDie(numBlocks, sizeof(MetaData));
+	int* pfTags = table->prefetcher != NULL ? callocOrDie(numBlocks, sizeof(int)) : NULL;
+	int* kept = table->keptPages != NULL ? callocOrDie(numBlocks, sizeof(int)) : NULL;
+	SetCounters* counters = table->stats != NULL ? callocOrDie(rows, sizeof(SetCounters)) : NULL;
+	BlockTimes* times = table->stats != NULL ? callocOrDie(numBlocks, sizeof(BlockTimes)) : NULL;
+	for(int i = 0; i < table->numPages; i++)
+	{
+		table->pages[i] = blocks + (size_t)i * table->pageBlocks;
+		if(pfTags != NULL)
+			table->pfPages[i] = pfTags + (size_t)i * table->pageBlocks;
+		if(kept != NULL)
+			table->keptPages[i] = kept + (size_t)i * table->pageBlocks;
+		if(counters != NULL)
 		{
-			a[j][i].tag = 0;
-			a[j][i].valid = 0;
-			a[j][i].dirty = 0;
-			a[j][i].LRU = 0;
+			table->stats->setPages[i] = counters + (size_t)i * table->pageRows;
+			table->stats->timePages[i] = times + (size_t)i * table->pageBlocks;
 		}
 	}
 }
 
+//First touch of a page in a sparse table.
+MetaData* allocPage(SetTable* table, int page)
+{
+	table->pages[page] = callocOrDie(table->pageBlocks, sizeof(MetaData));
+	if(table->prefetcher != NULL)
+		table->pfPages[page] = callocOrDie(table->pageBlocks, sizeof(int));
+	if(table->keptPages != NULL)
+		table->keptPages[page] = callocOrDie(table->pageBlocks, sizeof(int));
+	if(table->stats != NULL)
+	{
+		table->stats->setPages[page] = callocOrDie(table->pageRows, sizeof(SetCounters));
+		table->stats->timePages[page] = callocOrDie(table->pageBlocks, sizeof(BlockTimes));
+	}
+	return table->pages[page];
+}
+
+//Get the blocks of a set, allocating its page if this is the first touch.
+static inline MetaData* getSet(SetTable* table, int rowIndex)
+{
+	MetaData* page = table->pages[rowIndex >> SET_PAGE_SHIFT];
+	if(page == NULL)
+		page = allocPage(table, rowIndex >> SET_PAGE_SHIFT);
+	return page + (rowIndex & (SET_PAGE_ROWS - 1)) * table->associativity;
+}
+
+//Quotient of the block number by the prime set count, 0 unless the cache uses
+//prime modulo indexing.
+static inline addr_t primeQuotient(SetTable* table, addr_t address)
+{
+	addr_t block = (address & 0xffffffff) >> table->rowShift;
+	return (block * table->primeMagic) >> table->primeShift;
+}
+
+//XOR of the tag split into set-index-sized chunks. Three chunks cover the tag
+//of any cache with 256 or more sets.
+static inline int xorFold(SetTable* table, addr_t tagBits)
+{
+	return (tagBits ^ (tagBits >> table->foldShift) ^ (tagBits >> 2 * table->foldShift)) & table->xorMask;
+}
+
+//Set an address maps to. Plain modulo, XOR folding (xorMask is 0 for modulo)
+//and prime modulo (primeMagic and primeSets are 0 for the others) all share
+//this expression, so the default index takes no branches. Skewed caches do not
+//use it; each of their ways has its own set, see skewIndex().
+static inline int setIndex(SetTable* table, addr_t address)
+{
+	addr_t block = (address & 0xffffffff) >> table->rowShift;
+	addr_t fold = xorFold(table, (address & 0xffffffff) >> table->tagShift);
+	return ((block ^ fold) - primeQuotient(table, address) * table->primeSets) & table->rowMask;
+}
+
+//With prime modulo the tag is the quotient, which with the set gives back the
+//block. Otherwise the tag is the bits above the set index.
+static inline int blockTag(SetTable* table, addr_t address)
+{
+	return ((address >> table->tagShift) & table->tagMask) | primeQuotient(table, address);
+}
+
+//Hash of a tag for one way of a skewed cache.
+static inline int skewHash(SetTable* table, int tag, int way)
+{
+	return (((unsigned int)tag * (2 * way + 1) * 0x9E3779B1u) >> table->skewShift) & table->rowMask;
+}
+
+//Set a skewed cache uses for an address in one way.
+static inline int skewIndex(SetTable* table, addr_t address, int way)
+{
+	return (((address >> table->rowShift) ^ skewHash(table, blockTag(table, address), way))) & table->rowMask;
+}
+
+//Row holding an address's candidate block in a way.
+static inline int wayRow(SetTable* table, addr_t address, int way)
+{
+	if(table->indexing == Index_SKEWED)
+		return skewIndex(table, address, way);
+	return setIndex(table, address);
+}
+
+//Instrumentation for a set and its blocks. Only valid once getSet() has been
+//called for it.
+static inline SetCounters* getSetCounters(SetTable* table, int rowIndex)
+{
+	return &table->stats->setPages[rowIndex >> SET_PAGE_SHIFT][rowIndex & (SET_PAGE_ROWS - 1)];
+}
+
+static inline BlockTimes* getBlockTimes(SetTable* table, int rowIndex)
+{
+	return table->stats->timePages[rowIndex >> SET_PAGE_SHIFT] +
+		(rowIndex & (SET_PAGE_ROWS - 1)) * table->associativity;
+}
+
+//Histogram bucket of an interval: floor(log2(interval)), with 0 in bucket 0.
+static int histBucket(unsigned int interval)
+{
+#if defined(__GNUC__)
+	return interval == 0 ? 0 : 31 - __builtin_clz(interval);
+#else
+	int bucket = 0;
+	while(interval >>= 1)
+		bucket++;
+	return bucket;
+#endif
+}
+
+//Prefetch tags for a set. Only valid once getSet() has been called for it.
+static inline int* getPrefetchTags(SetTable* table, int rowIndex)
+{
+	return table->pfPages[rowIndex >> SET_PAGE_SHIFT] +
+		(rowIndex & (SET_PAGE_ROWS - 1)) * table->associativity;
+}
+
+//Kept-dirty flags for a set, see keptPages. Only valid once getSet() has been
+//called for it.
+static inline int* getKeptDirty(SetTable* table, int rowIndex)
+{
+	return table->keptPages[rowIndex >> SET_PAGE_SHIFT] +
+		(rowIndex & (SET_PAGE_ROWS - 1)) * table->associativity;
+}
+
+//A demand access touched a block. If it was prefetched and is still the same
+//block the prefetch was useful, otherwise it was replaced before being used.
+void notePrefetchTouch(SetTable* table, int rowIndex, int assoIndex)
+{
+	int* pfTags = getPrefetchTags(table, rowIndex);
+	if(pfTags[assoIndex] == 0)
+		return;
+	if(getSet(table, rowIndex)[assoIndex].tag == pfTags[assoIndex] - 1)
+		table->prefetcher->useful++;
+	else
+		table->prefetcher->useless++;
+	pfTags[assoIndex] = 0;
+}
+
 void setup_caches()
 {
 	/* Set up your caches here! */
 	srand(1000);//(unsigned int)time(NULL));
-	int numBlocks = icache_info.num_blocks;
-	int associativity = icache_info.associativity;
-	int numRows = numBlocks/associativity;
-	iCache = calloc(sizeof(MetaData*), numRows);
-	for(int i = 0; i < numRows; i++)
+	setUpVariables();
+	iCache.indexing = iIndexing;
+	if(iPrefetch.kind != Prefetch_NONE)
+		iCache.prefetcher = &iPrefetch;
+	if(statsPath != NULL)
 	{
-		iCache[i] = calloc(sizeof(MetaData), associativity);
+		iCache.stats = &iStats;
+		dCache.stats = &dStats;
 	}
-	setUpVariables(iCache, icache_info);
+	setUpTable(&iCache, icache_info);
 
 	dallocate = 0;
 	//Only allocate dCache if dCache data was given. 
 	if(dcache_info[0].associativity > 0)
 	{
 		dallocate = 1;
-		numBlocks = dcache_info[0].num_blocks;
-		associativity = dcache_info[0].associativity;
-		numRows = numBlocks/associativity;
-		dCache = calloc(sizeof(MetaData*), numRows);
-		for(int i = 0; i < numRows; i++)
-		{
-			dCache[i] = calloc(sizeof(MetaData), associativity);
-
-		}
-		setUpVariables(dCache, dcache_info[0]);
+		dCache.indexing = dIndexing[0];
+		if(dPrefetch.kind != Prefetch_NONE)
+			dCache.prefetcher = &dPrefetch;
+		setUpTable(&dCache, dcache_info[0]);
 	}
 
 	/* This call to dump_cache_info is just to show some debugging information
@@ -150,50 +595,200 @@ void setup_caches()
 
 //Increment the age of all elements in the block.
 //Set the newest element to zero.
-void fixLRU(int rowIndex, int indexToKeep, MetaData** cache, CacheInfo cache_info)
+void fixLRU(int rowIndex, int indexToKeep, SetTable* cache, CacheInfo cache_info)
 {
-	for(int i = 0; i < cache_info.associativity; i++)
+	MetaData* set = getSet(cache, rowIndex);
+	if(cache->indexing == Index_SKEWED)
+	{
+		//The ways of a skewed set sit in different rows, so ages can't be
+		//kept per row. Keep the time of last use instead.
+		set[indexToKeep].LRU = ++cache->useClock;
+	}
+	else
+	{
+		for(int i = 0; i < cache_info.associativity; i++)
+		{
+			set[i].LRU++;
+		}
+
+		set[indexToKeep].LRU = 0;
+	}
+	if(cache->prefetcher != NULL)
+		notePrefetchTouch(cache, rowIndex, indexToKeep);
+}
+
+//Block number of the block stored at a set, way and tag.
+addr_t blockAddress(SetTable* cache, int rowIndex, int assoIndex, int tag)
+{
+	if(cache->primeSets != 0)
+		return (addr_t)tag * cache->primeSets + rowIndex;
+
+	int low = rowIndex ^ xorFold(cache, tag);
+	if(cache->indexing == Index_SKEWED)
+		low = rowIndex ^ skewHash(cache, tag, assoIndex);
+	return ((addr_t)tag << (cache->tagShift - cache->rowShift)) | low;
+}
+
+void noteEviction(SetTable* cache, int rowIndex, int assoIndex)
+{
+	getSetCounters(cache, rowIndex)->evictions++;
+	unsigned int age = cache->stats->clock - getBlockTimes(cache, rowIndex)[assoIndex].fillTime;
+	cache->stats->evictionAge[histBucket(age)]++;
+}
+
+//Put a block evicted from the D-cache into the victim cache. The least
+//recently used entry makes room and is written to memory if it is dirty.
+void victimInsert(addr_t block, int dirty)
+{
+	VictimEntry* entry = &victimCache[0];
+	victimClock++;
+	for(int i = 0; i < victimEntries; i++)
 	{
-		cache[rowIndex][i].LRU++;
+		if(victimCache[i].valid && victimCache[i].block == block)
+		{
+			victimCache[i].dirty |= dirty;
+			victimCache[i].lastUse = victimClock;
+			return;
+		}
+		if(!victimCache[i].valid)
+		{
+			if(entry->valid)
+				entry = &victimCache[i];
+		}
+		else if(entry->valid && victimCache[i].lastUse < entry->lastUse)
+			entry = &victimCache[i];
 	}
 
-	cache[rowIndex][indexToKeep].LRU = 0;
+	if(entry->valid && entry->dirty)
+	{
+		numWordsWritten += dcache_info[0].words_per_block;
+		victimWritebacks -= dcache_info[0].words_per_block;
+	}
+	entry->block = block;
+	entry->valid = 1;
+	entry->dirty = dirty;
+	entry->lastUse = victimClock;
+}
+
+//A valid block is about to be replaced. Dirty blocks are written back, or
+//handed to the victim cache along with the rest of the D-cache victims.
+void evictBlock(SetTable* cache, CacheInfo cache_info, int rowIndex, int assoIndex)
+{
+	MetaData* block = &getSet(cache, rowIndex)[assoIndex];
+	if(cache->stats != NULL)
+		noteEviction(cache, rowIndex, assoIndex);
+	if(cache == &dCache && victimEntries > 0)
+	{
+		//Without -V the block would be written back now, unless it is only
+		//dirty because it came back from the victim cache. The saving is taken
+		//back if the victim cache writes it after all.
+		int* kept = getKeptDirty(cache, rowIndex);
+		if(block->dirty == 1 && kept[assoIndex] == 0)
+			victimWritebacks += cache_info.words_per_block;
+		kept[assoIndex] = 0;
+		victimInsert(blockAddress(cache, rowIndex, assoIndex, block->tag), block->dirty);
+	}
+	else if(block->dirty == 1)
+		numWordsWritten += cache_info.words_per_block;
+	block->dirty = 0;
+}
+
+//Number of words marked in a write-combining entry.
+static int countWords(unsigned long long words)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(words);
+#else
+	int count = 0;
+	for(; words != 0; words &= words - 1)
+		count++;
+	return count;
+#endif
+}
+
+//Write an entry of the write-combining buffer to memory and free it.
+void flushCombineEntry(CombineEntry* entry)
+{
+	int words = countWords(entry->words);
+	numWordsWritten += words;
+	combineWords += words;
+	entry->words = 0;
+}
+
+//A write-through store sends one word to memory, through the write-combining
+//buffer when there is one. A full buffer flushes its least recently used entry.
+void writeThroughWord()
+{
+	if(combineEntries == 0)
+	{
+		numWordsWritten++;
+		return;
+	}
+
+	addr_t block = storeAddress >> dCache.rowShift;
+	unsigned long long word = 1ULL << ((storeAddress >> 2) % dcache_info[0].words_per_block);
+	CombineEntry* entry = &combineBuffer[0];
+	combineClock++;
+	combineStores++;
+	for(int i = 0; i < combineEntries; i++)
+	{
+		if(combineBuffer[i].words != 0 && combineBuffer[i].block == block)
+		{
+			combineHits++;
+			combineBuffer[i].words |= word;
+			combineBuffer[i].lastUse = combineClock;
+			return;
+		}
+		if(combineBuffer[i].words == 0)
+		{
+			if(entry->words != 0)
+				entry = &combineBuffer[i];
+		}
+		else if(entry->words != 0 && combineBuffer[i].lastUse < entry->lastUse)
+			entry = &combineBuffer[i];
+	}
+
+	if(entry->words != 0)
+		flushCombineEntry(entry);
+	entry->block = block;
+	entry->words = word;
+	entry->lastUse = combineClock;
 }
 
 //Randomly replace data.
-int ranReplace(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
+int ranReplace(int rowIndex, SetTable* cache, CacheInfo cache_info, int tag)
 {
+	MetaData* set = getSet(cache, rowIndex);
 	int newAssoIndex = rand() % (cache_info.associativity - 1);
 	//Check if dirty even on reads 
-	if(cache[rowIndex][newAssoIndex].dirty == 1)
-		numWordsWritten += cache_info.words_per_block;
-	cache[rowIndex][newAssoIndex].tag = tag;
-	cache[rowIndex][newAssoIndex].valid = 1;
-	cache[rowIndex][newAssoIndex].dirty = 0;
+	evictBlock(cache, cache_info, rowIndex, newAssoIndex);
+	set[newAssoIndex].tag = tag;
+	set[newAssoIndex].valid = 1;
+	set[newAssoIndex].dirty = 0;
 	fixLRU(rowIndex, newAssoIndex, cache, cache_info);
 	return newAssoIndex;
 }
 
 //Find oldest data then replace it.
-int lruReplace(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
+int lruReplace(int rowIndex, SetTable* cache, CacheInfo cache_info, int tag)
 {
+	MetaData* set = getSet(cache, rowIndex);
 	int oldest = 0;
 	int lruIndex = 0;
 	for(int i = 0; i < cache_info.associativity; i++)
 	{
-		if(cache[rowIndex][i].LRU > oldest)
+		if(set[i].LRU > oldest)
 		{
-			oldest = cache[rowIndex][i].LRU;
+			oldest = set[i].LRU;
 			lruIndex = i;
 		}
 	}
 	
 	//Check if dirty even on reads 
-	if(cache[rowIndex][lruIndex].dirty == 1)
-		numWordsWritten += cache_info.words_per_block;
-	cache[rowIndex][lruIndex].tag = tag;
-	cache[rowIndex][lruIndex].valid = 1;
-	cache[rowIndex][lruIndex].dirty = 0;
+	evictBlock(cache, cache_info, rowIndex, lruIndex);
+	set[lruIndex].tag = tag;
+	set[lruIndex].valid = 1;
+	set[lruIndex].dirty = 0;
 	fixLRU(rowIndex, lruIndex, cache, cache_info);
 	return lruIndex;
 }
@@ -201,10 +796,11 @@ int lruReplace(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
 
 int isOpen(int rowIndex)
 {
+	MetaData* set = getSet(&dCache, rowIndex);
 	//Look for an invalid block in the set. 
 	for(int i = 0; i < dcache_info[0].associativity; i++)
 	{
-		if(dCache[rowIndex][i].valid == 0)
+		if(set[i].valid == 0)
 			return i;
 	}
 	return -1;
@@ -213,6 +809,7 @@ int isOpen(int rowIndex)
 //Fill in the invalid block with the appropriate write/alloc scheme. 
 void fillOpenSpace(int rowIndex, int openSpace, int numWordBlock, int tag)
 {
+	MetaData* set = getSet(&dCache, rowIndex);
 
 	if(dcache_info[0].write_scheme == Write_WRITE_THROUGH)
 	{
@@ -221,7 +818,7 @@ void fillOpenSpace(int rowIndex, int openSpace, int numWordBlock, int tag)
 		if(dcache_info[0].allocate_scheme == Allocate_NO_ALLOCATE)
 		{
 			//Do nothing to the cache when no allocate. 
-			numWordsWritten++;
+			writeThroughWord();
 			if(dcache_info[0].associativity == 1)
 				conflictW++;
 			else
@@ -235,55 +832,55 @@ void fillOpenSpace(int rowIndex, int openSpace, int numWordBlock, int tag)
 			{
 				numWordsRead += numWordBlock;
 			}
-			dCache[rowIndex][openSpace].tag = tag;
-			dCache[rowIndex][openSpace].valid = 1;
-			dCache[rowIndex][openSpace].dirty = 0;
-			numWordsWritten++;
+			set[openSpace].tag = tag;
+			set[openSpace].valid = 1;
+			set[openSpace].dirty = 0;
+			writeThroughWord();
 			compulW++;
-			fixLRU(rowIndex, openSpace, dCache, dcache_info[0]);
+			fixLRU(rowIndex, openSpace, &dCache, dcache_info[0]);
 		}
 	}
 	else if(dcache_info[0].write_scheme == Write_WRITE_BACK)
 	{
 		//Write the memory the words in the block and replace with new block. 
-		dCache[rowIndex][openSpace].tag = tag;
-		dCache[rowIndex][openSpace].valid = 1;
-		dCache[rowIndex][openSpace].dirty = 1;
+		set[openSpace].tag = tag;
+		set[openSpace].valid = 1;
+		set[openSpace].dirty = 1;
 		compulW++;
 		numWordsRead += numWordBlock;
-		fixLRU(rowIndex, openSpace, dCache, dcache_info[0]);
+		fixLRU(rowIndex, openSpace, &dCache, dcache_info[0]);
 	}
 }
 //Write to cache on the write hit. 
 void performWrite(int rowIndex, int assoIndex)
 {
+	MetaData* set = getSet(&dCache, rowIndex);
 	if(dcache_info[0].write_scheme == Write_WRITE_THROUGH)
 	{
 		//Write to memory and the Cache.
-		numWordsWritten++;
+		writeThroughWord();
 	}
 	else if(dcache_info[0].write_scheme == Write_WRITE_BACK)
 	{
 		//Write to Cache Normally Don't write to memory. Set dirty to one.
-		dCache[rowIndex][assoIndex].dirty = 1;
+		set[assoIndex].dirty = 1;
+		if(victimEntries > 0)
+			getKeptDirty(&dCache, rowIndex)[assoIndex] = 0;
 	}
 }
 //Write to memory when a write miss other than compulsory miss occurs. 
-void writeMem(int rowIndex, int index, MetaData** cache, CacheInfo cache_info, int tag)
+void writeMem(int rowIndex, int index, SetTable* cache, CacheInfo cache_info, int tag)
 {
+	MetaData* set = getSet(cache, rowIndex);
 	if(cache_info.write_scheme == Write_WRITE_BACK)
 	{
-		if(cache[rowIndex][index].dirty == 1)
-		{
-			numWordsWritten += cache_info.words_per_block; //if block is dirty, write it to memory then replace the cache block.
-			cache[rowIndex][index].dirty = 0;
-		}
+		evictBlock(cache, cache_info, rowIndex, index); //if block is dirty, write it to memory then replace the cache block.
 		//If block is clean override the block and write to memory. 
-		if(cache[rowIndex][index].dirty == 0)
+		if(set[index].dirty == 0)
 		{
-			cache[rowIndex][index].tag = tag;
-			cache[rowIndex][index].valid = 1;
-			cache[rowIndex][index].dirty = 1;
+			set[index].tag = tag;
+			set[index].valid = 1;
+			set[index].dirty = 1;
 			fixLRU(rowIndex, index, cache, cache_info);
 		}
 		numWordsRead += cache_info.words_per_block;
@@ -297,7 +894,7 @@ void writeMem(int rowIndex, int index, MetaData** cache, CacheInfo cache_info, i
 		//Write no alloc don't change the cache but write to memory. 
 		if(cache_info.allocate_scheme == Allocate_NO_ALLOCATE)
 		{
-			numWordsWritten++;
+			writeThroughWord();
 			if(dcache_info[0].associativity == 1)
 				conflictW++;
 			else
@@ -311,11 +908,12 @@ void writeMem(int rowIndex, int index, MetaData** cache, CacheInfo cache_info, i
 			{
 				numWordsRead += cache_info.words_per_block;
 			}
-			cache[rowIndex][index].tag = tag;
-			cache[rowIndex][index].valid = 1;
-			cache[rowIndex][index].dirty = 0;
+			evictBlock(cache, cache_info, rowIndex, index);
+			set[index].tag = tag;
+			set[index].valid = 1;
+			set[index].dirty = 0;
 			fixLRU(rowIndex, index, cache, cache_info);
-			numWordsWritten++;
+			writeThroughWord();
 			if(dcache_info[0].associativity == 1)
 				conflictW++;
 			else
@@ -325,7 +923,7 @@ void writeMem(int rowIndex, int index, MetaData** cache, CacheInfo cache_info, i
 
 }
 //Randomly replace data.
-int ranReplaceD(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
+int ranReplaceD(int rowIndex, SetTable* cache, CacheInfo cache_info, int tag)
 {
 	int newAssoIndex = rand() % (cache_info.associativity - 1);
 	writeMem(rowIndex, newAssoIndex, cache, cache_info, tag);
@@ -333,15 +931,16 @@ int ranReplaceD(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
 }
 
 //Find oldest data then replace it.
-int lruReplaceD(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
+int lruReplaceD(int rowIndex, SetTable* cache, CacheInfo cache_info, int tag)
 {
+	MetaData* set = getSet(cache, rowIndex);
 	int oldest = 0;
 	int lruIndex = 0;
 	for(int i = 0; i < cache_info.associativity; i++)
 	{
-		if(cache[rowIndex][i].LRU > oldest)
+		if(set[i].LRU > oldest)
 		{
-			oldest = cache[rowIndex][i].LRU;
+			oldest = set[i].LRU;
 			lruIndex = i;
 		}
 	}
@@ -352,29 +951,21 @@ int lruReplaceD(int rowIndex, MetaData** cache, CacheInfo cache_info, int tag)
 //Look for address in the cache.
 //If not found read from memory and count up the appropriate miss.
 //If found increment number of hits.
-void cacheAccess(addr_t address, MetaData** cache, CacheInfo cache_info, int whichCounts)
+void cacheAccess(addr_t address, SetTable* cache, CacheInfo cache_info, int whichCounts)
 {
-	int numWordBlock = cache_info.words_per_block;
-	int numBlocks = cache_info.num_blocks;
-	int wordBit = (int) ceil(log2(numWordBlock));
-	int rowBit = (int) ceil(log2(numBlocks/cache_info.associativity));
-	int tagBit = 32 - wordBit - rowBit - 2;
-	int rowShift = wordBit + 2;
-	int tagShift = wordBit + rowBit + 2;
-	int rowMask = (1 << rowBit) - 1;
-	int tagMask = (1 << tagBit) - 1;
 	if(whichCounts)
 		numReads++;
 	else
 		numReadsD++;
 	//Find the rowIndex, associativity index and tag.
-	int rowIndex = (address >> rowShift) & rowMask;
+	int rowIndex = setIndex(cache, address);
 	int assoIndex = 0;
-	int tag = (address >> tagShift) & tagMask;
+	int tag = blockTag(cache, address);
+	MetaData* set = getSet(cache, rowIndex);
 
 	//If requested block is empty read from memory.
 	//Compulsory Miss
-	if(cache[rowIndex][assoIndex].valid == 0)
+	if(set[assoIndex].valid == 0)
 	{
 		if(whichCounts)
 			compul++;
@@ -382,15 +973,15 @@ void cacheAccess(addr_t address, MetaData** cache, CacheInfo cache_info, int whi
 		{
 			compulD++;
 		}
-		cache[rowIndex][assoIndex].tag = tag;
-		cache[rowIndex][assoIndex].valid = 1;
+		set[assoIndex].tag = tag;
+		set[assoIndex].valid = 1;
 		fixLRU(rowIndex, assoIndex, cache, cache_info);
 		return;
 	}
 	else
 	{
 		//If requested block is found increment hit and fix lru.
-		if(cache[rowIndex][assoIndex].tag == tag)
+		if(set[assoIndex].tag == tag)
 		{
 			if(whichCounts)
 				readHits++;
@@ -408,16 +999,25 @@ void cacheAccess(addr_t address, MetaData** cache, CacheInfo cache_info, int whi
 					conflict++;
 				else
 					conflictD++;
-				cache[rowIndex][0].tag = tag;
-				cache[rowIndex][0].valid = 1;
+				//A read conflict has always just overwritten the block, and a dirty
+				//one passes its dirty bit on to the new block instead of being
+				//written back. Keep that with -V so its runs compare with plain
+				//ones: only clean victims go to the victim cache.
+				if(cache == &dCache && victimEntries > 0 && set[0].dirty == 0)
+					evictBlock(cache, cache_info, rowIndex, 0);
+				else if(cache->stats != NULL)
+					noteEviction(cache, rowIndex, 0);
+				set[0].tag = tag;
+				set[0].valid = 1;
+				fixLRU(rowIndex, 0, cache, cache_info);
 			}
 			else //If not direct mapped check other blocks in set. 
 			{
 				for(int i = 0; i < cache_info.associativity; i++)
 				{
-					if(cache[rowIndex][i].valid == 1)
+					if(set[i].valid == 1)
 					{
-						if(cache[rowIndex][i].tag == tag) //If found in the set its a hit. 
+						if(set[i].tag == tag) //If found in the set its a hit. 
 						{
 							fixLRU(rowIndex, i, cache, cache_info);
 							if(whichCounts)
@@ -429,15 +1029,15 @@ void cacheAccess(addr_t address, MetaData** cache, CacheInfo cache_info, int whi
 						}
 					}
 					//Check for open space and replace if found. Empty block so compulsory miss. 
-					else if(cache[rowIndex][i].valid == 0)
+					else if(set[i].valid == 0)
 					{
 						if(whichCounts)
 							compul++;
 						else
 							compulD++;
 
-						cache[rowIndex][i].tag = tag;
-						cache[rowIndex][i].valid = 1;
+						set[i].tag = tag;
+						set[i].valid = 1;
 						fixLRU(rowIndex, i, cache, cache_info);
 						return;
 					}
@@ -459,34 +1059,28 @@ void cacheAccess(addr_t address, MetaData** cache, CacheInfo cache_info, int whi
 void dWrite(addr_t address)
 {
 	int numWordBlock = dcache_info[0].words_per_block;
-	int numBlocks = dcache_info[0].num_blocks;
-	int wordBit = (int) ceil(log2(numWordBlock));
-	int rowBit = (int) ceil(log2(numBlocks/dcache_info[0].associativity));
-	int tagBit = 32 - wordBit - rowBit - 2;
-	int rowShift = wordBit + 2;
-	int tagShift = wordBit + rowBit + 2;
-	int rowMask = (1 << rowBit) - 1;
-	int tagMask = (1 << tagBit) - 1;
 
 	//Find the rowIndex, associativity index and tag.
-	int rowIndex = (address >> rowShift) & rowMask;
+	int rowIndex = setIndex(&dCache, address);
 	int assoIndex = 0;
-	int tag = (address >> tagShift) & tagMask;
+	int tag = blockTag(&dCache, address);
+	MetaData* set = getSet(&dCache, rowIndex);
+	storeAddress = address;
 	numWrites++;
-	if(dCache[rowIndex][assoIndex].valid == 1)
+	if(set[assoIndex].valid == 1)
 	{
-		if(dCache[rowIndex][assoIndex].tag == tag) //Valid block and tag match == Hit
+		if(set[assoIndex].tag == tag) //Valid block and tag match == Hit
 		{
 			wHits++;
 			performWrite(rowIndex, assoIndex);
-			fixLRU(rowIndex, assoIndex, dCache, dcache_info[0]);
+			fixLRU(rowIndex, assoIndex, &dCache, dcache_info[0]);
 			return;
 		}
 		else //Valid block but tag doesn't match
 		{
 			if(dcache_info[0].associativity == 1) //Valid block, tag doesn't match and direct Mapped == conflict miss
 			{
-				writeMem(rowIndex, assoIndex, dCache, dcache_info[0], tag);
+				writeMem(rowIndex, assoIndex, &dCache, dcache_info[0], tag);
 				return;
 			}
 			else //Valid block, tag doesn't match and associativity is greater than 1
@@ -495,13 +1089,13 @@ void dWrite(addr_t address)
 				//If tag is found its a hit
 				for(int i = 1; i < dcache_info[0].associativity; i++)
 				{
-					if(dCache[rowIndex][i].valid == 1)
+					if(set[i].valid == 1)
 					{
-						if(dCache[rowIndex][i].tag == tag)
+						if(set[i].tag == tag)
 						{
 							wHits++;
 							performWrite(rowIndex, i);
-							fixLRU(rowIndex, i, dCache, dcache_info[0]);
+							fixLRU(rowIndex, i, &dCache, dcache_info[0]);
 							return;
 						}
 					}
@@ -518,9 +1112,9 @@ void dWrite(addr_t address)
 				else //No open space found so capacity miss.
 				{
 					if(dcache_info[0].replacement == Replacement_RANDOM)
-						ranReplaceD(rowIndex, dCache, dcache_info[0], tag);
+						ranReplaceD(rowIndex, &dCache, dcache_info[0], tag);
 					else if(dcache_info[0].replacement == Replacement_LRU)
-						lruReplaceD(rowIndex, dCache, dcache_info[0], tag);
+						lruReplaceD(rowIndex, &dCache, dcache_info[0], tag);
 					return;
 				}
 			}
@@ -533,6 +1127,439 @@ void dWrite(addr_t address)
 	}
 }
 
+//Look for a block without touching anything. Returns the way or -1, and the
+//row of that way in *rowIndex if it is not NULL.
+int findBlock(SetTable* cache, addr_t address, int* rowIndex)
+{
+	int tag = blockTag(cache, address);
+	for(int i = 0; i < cache->associativity; i++)
+	{
+		int row = wayRow(cache, address, i);
+		MetaData* block = &getSet(cache, row)[i];
+		if(block->valid == 1 && block->tag == tag)
+		{
+			if(rowIndex != NULL)
+				*rowIndex = row;
+			return i;
+		}
+	}
+	return -1;
+}
+
+//Pick the way a new block for address goes into: the first open way if there
+//is one, otherwise one chosen by the replacement scheme. The row of that way
+//goes in *rowIndex. Nothing is evicted here.
+int pickVictim(SetTable* cache, CacheInfo cache_info, addr_t address, int* rowIndex)
+{
+	int way = 0;
+	for(int i = 0; i < cache_info.associativity; i++)
+	{
+		*rowIndex = wayRow(cache, address, i);
+		if(getSet(cache, *rowIndex)[i].valid == 0)
+			return i;
+	}
+
+	if(cache_info.associativity == 1)
+		way = 0;
+	else if(cache_info.replacement == Replacement_RANDOM)
+		way = rand() % (cache_info.associativity - 1);
+	else if(cache->indexing == Index_SKEWED)
+	{
+		//Least recent use time.
+		for(int i = 1; i < cache_info.associativity; i++)
+		{
+			if(getSet(cache, wayRow(cache, address, i))[i].LRU <
+				getSet(cache, wayRow(cache, address, way))[way].LRU)
+				way = i;
+		}
+	}
+	else
+	{
+		MetaData* set = getSet(cache, *rowIndex);
+		int oldest = 0;
+		for(int i = 0; i < cache_info.associativity; i++)
+		{
+			if(set[i].LRU > oldest)
+			{
+				oldest = set[i].LRU;
+				way = i;
+			}
+		}
+	}
+	*rowIndex = wayRow(cache, address, way);
+	return way;
+}
+
+//Read or write for a skewed-associative cache, where each way has its own index
+//function so a block's candidate slots sit in different rows. Hits, misses and
+//fills are counted the same way as in cacheAccess() and dWrite().
+void skewedAccess(AccessType type, addr_t address, SetTable* cache, CacheInfo cache_info)
+{
+	int tag = blockTag(cache, address);
+	int rowIndex;
+	int way = findBlock(cache, address, &rowIndex);
+
+	if(type == Access_D_WRITE)
+	{
+		storeAddress = address;
+		numWrites++;
+		if(way != -1)
+		{
+			wHits++;
+			performWrite(rowIndex, way);
+			fixLRU(rowIndex, way, cache, cache_info);
+			return;
+		}
+		way = pickVictim(cache, cache_info, address, &rowIndex);
+		if(getSet(cache, rowIndex)[way].valid == 0)
+			fillOpenSpace(rowIndex, way, cache_info.words_per_block, tag);
+		else
+			writeMem(rowIndex, way, cache, cache_info, tag);
+		return;
+	}
+
+	int whichCounts = type == Access_I_FETCH;
+	if(whichCounts)
+		numReads++;
+	else
+		numReadsD++;
+	if(way != -1)
+	{
+		if(whichCounts)
+			readHits++;
+		else
+			readHitsD++;
+		fixLRU(rowIndex, way, cache, cache_info);
+		return;
+	}
+
+	way = pickVictim(cache, cache_info, address, &rowIndex);
+	MetaData* block = &getSet(cache, rowIndex)[way];
+	if(block->valid == 0)
+	{
+		if(whichCounts)
+			compul++;
+		else
+			compulD++;
+	}
+	else
+	{
+		if(whichCounts)
+			capacity++;
+		else
+			capacityD++;
+		evictBlock(cache, cache_info, rowIndex, way);
+	}
+	block->tag = tag;
+	block->valid = 1;
+	block->dirty = 0;
+	fixLRU(rowIndex, way, cache, cache_info);
+}
+
+//Hand a demand access to the lookup for the cache's organisation.
+void lookup(AccessType type, addr_t address, SetTable* cache, CacheInfo cache_info)
+{
+	if(cache->indexing == Index_SKEWED)
+		skewedAccess(type, address, cache, cache_info);
+	else if(type == Access_D_WRITE)
+		dWrite(address);
+	else
+		cacheAccess(address, cache, cache_info, type == Access_I_FETCH);
+}
+
+//D-cache access with a victim cache. On an L1 miss that finds its block in the
+//victim cache, the block moves back into L1 instead of being read from memory.
+//It still counts as an L1 miss.
+void victimAccess(AccessType type, addr_t address)
+{
+	addr_t block = address >> dCache.rowShift;
+	VictimEntry* entry = NULL;
+	if(findBlock(&dCache, address, NULL) == -1)
+	{
+		for(int i = 0; i < victimEntries; i++)
+		{
+			if(victimCache[i].valid && victimCache[i].block == block)
+			{
+				entry = &victimCache[i];
+				break;
+			}
+		}
+	}
+
+	if(entry == NULL)
+	{
+		lookup(type, address, &dCache, dcache_info[0]);
+		return;
+	}
+
+	//Take the block out first so the L1 victim can use its entry.
+	VictimEntry saved = *entry;
+	entry->valid = 0;
+	int wordsReadBefore = numWordsRead;
+	lookup(type, address, &dCache, dcache_info[0]);
+
+	int rowIndex;
+	int way = findBlock(&dCache, address, &rowIndex);
+	if(way == -1)
+	{
+		//Write-no-allocate left the block where it was.
+		*entry = saved;
+		return;
+	}
+
+	//A block that is not dirty already would have come back clean from memory.
+	MetaData* restored = &getSet(&dCache, rowIndex)[way];
+	if(saved.dirty && restored->dirty == 0)
+	{
+		restored->dirty = 1;
+		getKeptDirty(&dCache, rowIndex)[way] = 1;
+	}
+	if(type == Access_D_WRITE)
+	{
+		victimWriteHits++;
+		victimFetchWords += numWordsRead - wordsReadBefore;
+		numWordsRead = wordsReadBefore;
+	}
+	else
+	{
+		victimReadHits++;
+		victimReadWords += dcache_info[0].words_per_block;
+	}
+}
+
+//If the block is resident, count the access against its row and note how
+//long it has been since it was last touched. Returns the way it was found in
+//or -1; misses are counted by statsAfter() once the block has a row.
+int statsBefore(SetTable* cache, addr_t address)
+{
+	int rowIndex;
+	int way = findBlock(cache, address, &rowIndex);
+	cache->stats->clock++;
+	if(way != -1)
+	{
+		getSetCounters(cache, rowIndex)->accesses++;
+		unsigned int interval = cache->stats->clock - getBlockTimes(cache, rowIndex)[way].lastTouch;
+		cache->stats->reuse[histBucket(interval)]++;
+	}
+	return way;
+}
+
+//A miss counts against the row the block was filled into. One that was not
+//allocated counts against the row of way 0, which findBlock() has allocated.
+void statsAfter(SetTable* cache, addr_t address, int hitWay)
+{
+	int rowIndex = wayRow(cache, address, 0);
+	int way = findBlock(cache, address, &rowIndex);
+	if(hitWay == -1)
+	{
+		getSetCounters(cache, rowIndex)->accesses++;
+		getSetCounters(cache, rowIndex)->misses++;
+	}
+	if(way == -1)
+		return;
+	if(hitWay == -1)
+		getBlockTimes(cache, rowIndex)[way].fillTime = cache->stats->clock;
+	getBlockTimes(cache, rowIndex)[way].lastTouch = cache->stats->clock;
+}
+
+//A demand access to a cache, through the victim cache when there is one.
+void demandAccess(AccessType type, addr_t address, SetTable* cache, CacheInfo cache_info)
+{
+	int hitWay = -1;
+	if(cache->stats != NULL)
+		hitWay = statsBefore(cache, address);
+
+	if(cache == &dCache && victimEntries > 0)
+		victimAccess(type, address);
+	else
+		lookup(type, address, cache, cache_info);
+
+	if(cache->stats != NULL)
+		statsAfter(cache, address, hitWay);
+}
+
+//Count a block read from memory by a prefetcher. Data cache prefetches go into
+//numWordsRead along with the demand traffic.
+void countPrefetchRead(SetTable* cache, CacheInfo cache_info)
+{
+	cache->prefetcher->issued++;
+	cache->prefetcher->wordsRead += cache_info.words_per_block;
+	if(cache == &dCache)
+		numWordsRead += cache_info.words_per_block;
+}
+
+//Put a prefetched block into the cache. It goes into an open way if there is
+//one, otherwise it replaces a block picked the same way demand misses pick
+//one. Blocks coming out of a stream buffer were already read from memory, so
+//they are not counted again.
+void prefetchFill(SetTable* cache, CacheInfo cache_info, addr_t block, int fromMemory)
+{
+	addr_t address = block << cache->rowShift;
+	if(findBlock(cache, address, NULL) != -1)
+		return;
+
+	int tag = blockTag(cache, address);
+	int rowIndex;
+	int way = pickVictim(cache, cache_info, address, &rowIndex);
+	MetaData* set = getSet(cache, rowIndex);
+	int* pfTags = getPrefetchTags(cache, rowIndex);
+	if(set[way].valid == 1)
+	{
+		evictBlock(cache, cache_info, rowIndex, way);
+		if(pfTags[way] != 0)
+			cache->prefetcher->useless++;
+	}
+
+	set[way].tag = tag;
+	set[way].valid = 1;
+	set[way].dirty = 0;
+	pfTags[way] = 0;
+	fixLRU(rowIndex, way, cache, cache_info);
+	pfTags[way] = tag + 1;
+	if(cache->stats != NULL)
+	{
+		getBlockTimes(cache, rowIndex)[way].fillTime = cache->stats->clock;
+		getBlockTimes(cache, rowIndex)[way].lastTouch = cache->stats->clock;
+	}
+	if(fromMemory)
+		countPrefetchRead(cache, cache_info);
+}
+
+//Read blocks into a stream buffer until it is full.
+void fillStream(StreamBuffer* stream, SetTable* cache, CacheInfo cache_info)
+{
+	while(stream->count < cache->prefetcher->degree)
+	{
+		stream->count++;
+		countPrefetchRead(cache, cache_info);
+	}
+}
+
+//Called on a cache miss. If a stream buffer holds the block, the blocks ahead
+//of it are dropped, it moves into the cache and the buffer is topped back up.
+//Otherwise the least recently used buffer restarts after the missing block.
+void streamMiss(SetTable* cache, CacheInfo cache_info, addr_t block)
+{
+	Prefetcher* pf = cache->prefetcher;
+	StreamBuffer* victim = &pf->streams[0];
+	pf->clock++;
+	for(int i = 0; i < NUM_STREAMS; i++)
+	{
+		StreamBuffer* stream = &pf->streams[i];
+		if(stream->count > 0 && block >= stream->head && block < stream->head + stream->count)
+		{
+			int skipped = (int)(block - stream->head);
+			pf->useless += skipped;
+			prefetchFill(cache, cache_info, block, 0);
+			stream->head = block + 1;
+			stream->count -= skipped + 1;
+			stream->lastUse = pf->clock;
+			fillStream(stream, cache, cache_info);
+			return;
+		}
+		if(stream->lastUse < victim->lastUse)
+			victim = stream;
+	}
+
+	pf->useless += victim->count;
+	victim->head = block + pf->distance;
+	victim->count = 0;
+	victim->lastUse = pf->clock;
+	fillStream(victim, cache, cache_info);
+}
+
+//Train the reference prediction table on an access from pc and prefetch ahead
+//once the entry has seen the same stride twice in a row.
+void strideAccess(SetTable* cache, CacheInfo cache_info, addr_t pc, addr_t block)
+{
+	Prefetcher* pf = cache->prefetcher;
+	StrideEntry* entry = &pf->rpt[(pc >> 2) % RPT_SIZE];
+	if(entry->pc != pc || entry->last == 0)
+	{
+		entry->pc = pc;
+		entry->last = block;
+		entry->stride = 0;
+		entry->state = Stride_INITIAL;
+		return;
+	}
+	//Another access to the same block tells us nothing new.
+	if(block == entry->last)
+		return;
+
+	long stride = (long)(block - entry->last);
+	int correct = stride == entry->stride;
+	switch(entry->state)
+	{
+		case Stride_INITIAL:
+			if(correct)
+				entry->state = Stride_STEADY;
+			else
+			{
+				entry->stride = stride;
+				entry->state = Stride_TRANSIENT;
+			}
+			break;
+		case Stride_TRANSIENT:
+			if(correct)
+				entry->state = Stride_STEADY;
+			else
+			{
+				entry->stride = stride;
+				entry->state = Stride_NO_PRED;
+			}
+			break;
+		case Stride_STEADY:
+			if(!correct)
+				entry->state = Stride_INITIAL;
+			break;
+		case Stride_NO_PRED:
+			if(correct)
+				entry->state = Stride_TRANSIENT;
+			else
+				entry->stride = stride;
+			break;
+	}
+	entry->last = block;
+
+	if(entry->state == Stride_STEADY)
+	{
+		for(int i = 0; i < pf->degree; i++)
+			prefetchFill(cache, cache_info, block + entry->stride * (pf->distance + i), 1);
+	}
+}
+
+//Run a demand access through a cache that has a prefetcher, then let the
+//prefetcher react to it. The pc is only used by the stride prefetcher.
+void prefetchAccess(AccessType type, addr_t address, SetTable* cache, CacheInfo cache_info, addr_t pc)
+{
+	Prefetcher* pf = cache->prefetcher;
+	addr_t block = address >> cache->rowShift;
+	if(pf->kind == Prefetch_STREAM && findBlock(cache, address, NULL) == -1)
+		streamMiss(cache, cache_info, block);
+
+	int hitsBefore = readHits + readHitsD + wHits;
+	int usefulBefore = pf->useful;
+	demandAccess(type, address, cache, cache_info);
+	int miss = readHits + readHitsD + wHits == hitsBefore;
+
+	switch(pf->kind)
+	{
+		case Prefetch_NEXT_LINE:
+			//Tagged: a first use of a prefetched block also triggers the next one.
+			if(miss || pf->useful != usefulBefore)
+			{
+				for(int i = 0; i < pf->degree; i++)
+					prefetchFill(cache, cache_info, block + pf->distance + i, 1);
+			}
+			break;
+		case Prefetch_STRIDE:
+			strideAccess(cache, cache_info, pc, block);
+			break;
+		default:
+			break;
+	}
+}
+
 void handle_access(AccessType type, addr_t address)
 {
 	/* This is where all the fun stuff happens! This function is called to
@@ -543,19 +1570,206 @@ void handle_access(AccessType type, addr_t address)
 	{
 		case Access_I_FETCH:
 			/* These prints are just for debugging and should be removed. */
-			cacheAccess(address, iCache, icache_info, 1);
+			lastFetch = address;
+			if(iCache.prefetcher != NULL)
+				prefetchAccess(type, address, &iCache, icache_info, 0);
+			else
+				demandAccess(type, address, &iCache, icache_info);
 			break;
 		case Access_D_READ:
-			if(dallocate)
-				cacheAccess(address, dCache, dcache_info[0], 0);
-			break;
 		case Access_D_WRITE:
-			if(dallocate)
-				dWrite(address);
+			if(dallocate && dCache.prefetcher != NULL)
+				prefetchAccess(type, address, &dCache, dcache_info[0], lastFetch);
+			else if(dallocate)
+				demandAccess(type, address, &dCache, dcache_info[0]);
 			break;
 	}
 }
 
+//Batched trace loop for -B.
+//Parses a whole window of records, then prefetches the set each one lands in,
+//then runs the records through handle_access() in order. Only host memory is
+//prefetched, so records in the same window that hit the same set are still
+//simulated exactly one after another. Build with -DNO_SET_PREFETCH to keep the
+//batching but drop the prefetches.
+#define MAX_BATCH_WINDOW 256
+
+#if defined(__GNUC__) && !defined(NO_SET_PREFETCH)
+#define PREFETCH_SET(p) __builtin_prefetch((p), 1)
+#else
+#define PREFETCH_SET(p) ((void)(p))
+#endif
+
+typedef struct
+{
+	AccessType type;
+	addr_t address;
+} TraceRecord;
+
+int batchWindow;
+
+//Same format and checks as read_trace_line(). Returns 0 at end of file.
+static int readRecord(FILE* trace, TraceRecord* rec)
+{
+	char line[100];
+	char type;
+
+	while(fgets(line, sizeof(line), trace) != NULL)
+	{
+		if(sscanf(line, "0x%lx %c", &rec->address, &type) < 2)
+			continue;
+
+		switch(type)
+		{
+			case 'R': rec->type = Access_D_READ; return 1;
+			case 'W': rec->type = Access_D_WRITE; return 1;
+			case 'I': rec->type = Access_I_FETCH; return 1;
+			default:
+				fprintf(stderr, "Malformed trace file: invalid access type '%c'.\n",
+					type);
+				exit(1);
+		}
+	}
+	return 0;
+}
+
+//Cache an access goes to, or NULL if there is no D-cache.
+static SetTable* recordTable(TraceRecord* rec)
+{
+	if(rec->type == Access_I_FETCH)
+		return &iCache;
+	return dallocate ? &dCache : NULL;
+}
+
+//Like getSet(), but returns NULL instead of allocating a page that has not
+//been touched yet; handle_access() allocates it.
+static MetaData* peekSet(SetTable* table, int rowIndex)
+{
+	MetaData* page = table->pages[rowIndex >> SET_PAGE_SHIFT];
+	if(page == NULL)
+		return NULL;
+	return page + (rowIndex & (SET_PAGE_ROWS - 1)) * table->associativity;
+}
+
+void runBatched(FILE* trace)
+{
+	TraceRecord window[MAX_BATCH_WINDOW];
+	int count;
+
+	do
+	{
+		count = 0;
+		while(count < batchWindow && readRecord(trace, &window[count]))
+			count++;
+
+		//Prefetch the set of every record before simulating any of them. The
+		//prefetches stay in this loop rather than a helper: GCC treats a
+		//function whose only effect is a prefetch as pure and drops the calls.
+		for(int i = 0; i < count; i++)
+		{
+			SetTable* table = recordTable(&window[i]);
+			if(table == NULL)
+				continue;
+			if(table->indexing == Index_SKEWED)
+			{
+				//Each way of a skewed cache has its candidate block in its own row.
+				for(int way = 0; way < table->associativity; way++)
+				{
+					MetaData* set = peekSet(table, wayRow(table, window[i].address, way));
+					if(set != NULL)
+						PREFETCH_SET(set + way);
+				}
+				continue;
+			}
+			MetaData* set = peekSet(table, setIndex(table, window[i].address));
+			if(set == NULL)
+				continue;
+			PREFETCH_SET(set);
+			PREFETCH_SET(set + table->associativity - 1);
+		}
+
+		for(int i = 0; i < count; i++)
+			handle_access(window[i].type, window[i].address);
+	} while(count == batchWindow);
+}
+
+//Write one cache's instrumentation. Sets that were never touched are skipped.
+void dumpStats(FILE* out, const char* name, SetTable* cache)
+{
+	CacheStats* stats = cache->stats;
+	for(int page = 0; page < cache->numPages; page++)
+	{
+		if(stats->setPages[page] == NULL)
+			continue;
+		for(int i = 0; i < cache->pageRows; i++)
+		{
+			SetCounters* c = &stats->setPages[page][i];
+			if(c->accesses != 0 || c->evictions != 0)
+			{
+				fprintf(out, "set,%s,%d,%d,%d,%d\n", name, (page << SET_PAGE_SHIFT) + i,
+					c->accesses, c->misses, c->evictions);
+			}
+		}
+	}
+	for(int b = 0; b < HIST_BUCKETS; b++)
+	{
+		if(stats->reuse[b] != 0)
+			fprintf(out, "reuse,%s,%u,%d,,\n", name, 1u << b, stats->reuse[b]);
+	}
+	for(int b = 0; b < HIST_BUCKETS; b++)
+	{
+		if(stats->evictionAge[b] != 0)
+			fprintf(out, "age,%s,%u,%d,,\n", name, 1u << b, stats->evictionAge[b]);
+	}
+}
+
+//Called once the whole trace has been simulated.
+void finishTrace()
+{
+	//Stores still sitting in the write-combining buffer go to memory.
+	for(int i = 0; i < combineEntries; i++)
+	{
+		if(combineBuffer[i].words != 0)
+			flushCombineEntry(&combineBuffer[i]);
+	}
+
+	if(statsPath != NULL)
+	{
+		FILE* out = fopen(statsPath, "w");
+		if(out == NULL)
+		{
+			fprintf(stderr, "Could not open %s for writing.\n", statsPath);
+			return;
+		}
+		//set rows: index, accesses, misses, evictions.
+		//reuse/age rows: bucket lower bound in accesses, count; the last two
+		//columns are left empty.
+		fprintf(out, "record,cache,index,value,misses,evictions\n");
+		dumpStats(out, "I", &iCache);
+		if(dallocate)
+			dumpStats(out, "D", &dCache);
+		fclose(out);
+	}
+}
+
+void printPrefetchStats(const char* name, Prefetcher* pf, int misses)
+{
+	static const char* kinds[] = {"none", "next-line", "stride", "stream buffers"};
+	printf("\n\n");
+	printf("%s Prefetcher (%s, degree %d, distance %d):\n", name, kinds[pf->kind],
+		pf->degree, pf->distance);
+	printf("Prefetches Issued: %28d\n", pf->issued);
+	printf("Useful Prefetches: %28d\n", pf->useful);
+	printf("Useless Prefetches: %27d\n", pf->useless);
+	printf("Prefetch Words Read: %26d\n", pf->wordsRead);
+	//Accuracy is the share of prefetches that got used. Coverage is the share
+	//of would-be misses the prefetcher removed.
+	printf("Prefetch Accuracy: %28.2f%%\n",
+		pf->issued == 0 ? 0.0 : ((double)pf->useful/(double)pf->issued) * 100);
+	printf("Prefetch Coverage: %28.2f%%\n",
+		pf->useful + misses == 0 ? 0.0 : ((double)pf->useful/(double)(pf->useful + misses)) * 100);
+}
+
 void print_statistics()
 {
 	/* Finally, after all the simulation happens, you have to show what the
@@ -566,7 +1780,7 @@ void print_statistics()
 	int readDataMisses = compulD + conflictD + capacityD; 
 	printf("I-cache Stats: \n");
 	printf("Number of Reads: %30d\n", numReads);
-	printf("Number of Words: %30d\n", readMisses * icache_info.words_per_block);
+	printf("Number of Words: %30d\n", readMisses * icache_info.words_per_block + iPrefetch.wordsRead);
 	printf("Read Misses:\n");
 	printf("       Compulsory Miss: %23d\n", compul);
 	printf("       Conflict Misses: %23d\n", conflict);
@@ -578,7 +1792,7 @@ void print_statistics()
 	printf("\n\n");
 	printf("L1 D-cache Stats:\n");
 	printf("Number of Reads: %30d\n", numReadsD);
-	printf("Number of Words Read: %25d\n", numWordsRead + (readDataMisses * dcache_info[0].words_per_block));
+	printf("Number of Words Read: %25d\n", numWordsRead + (readDataMisses * dcache_info[0].words_per_block) - victimReadWords);
 	printf("Number of Writes: %29d\n", numWrites);
 	printf("Number of Words Writen: %23d\n", numWordsWritten);
 	printf("Read Misses:\n");
@@ -599,6 +1813,235 @@ void print_statistics()
 	printf("       Write Miss rate With Compulsory: %7.2f%%\n", ((double)wMisses/(double)numWrites) * 100 );	
 	wMisses -= compulW; 
 	printf("       Write Miss rate Without Compulsory: %3.2f%%\n", ((double)wMisses/(double)numWrites) * 100 );
+
+	if(iPrefetch.kind != Prefetch_NONE)
+		printPrefetchStats("I-cache", &iPrefetch, compul + conflict + capacity);
+	if(dPrefetch.kind != Prefetch_NONE)
+		printPrefetchStats("L1 D-cache", &dPrefetch,
+			compulD + conflictD + capacityD + compulW + conflictW + capacityW);
+
+	//Words saved are already taken out of the words read/written above.
+	if(combineEntries > 0)
+	{
+		printf("\n\n");
+		printf("Write-Combining Buffer (%d entries):\n", combineEntries);
+		printf("Stores Buffered: %30d\n", combineStores);
+		printf("Merged Stores: %32d\n", combineHits);
+		printf("Words Written: %32d\n", combineWords);
+		printf("Words Written Saved: %26d\n", combineStores - combineWords);
+	}
+	if(victimEntries > 0)
+	{
+		printf("\n\n");
+		printf("Victim Cache (%d entries):\n", victimEntries);
+		printf("Read Hits: %36d\n", victimReadHits);
+		printf("Write Hits: %35d\n", victimWriteHits);
+		printf("Words Read Saved: %29d\n", victimReadWords + victimFetchWords);
+		printf("Words Written Saved: %26d\n", victimWritebacks);
+	}
+}
+
+//Result store.
+//A run is keyed by a fingerprint of the trace (size, mtime and a hash of a few
+//sampled chunks) plus the cache parameters. Bump RESULT_VERSION whenever the
+//simulation changes so old results are not reused.
+#define RESULT_VERSION 3
+#define RESULT_SAMPLES 16
+#define RESULT_SAMPLE_SIZE 4096
+
+typedef struct
+{
+	const char* name;
+	int* value;
+} ResultCounter;
+
+//Every counter print_statistics() reads.
+static ResultCounter resultCounters[] =
+{
+	{"numReads", &numReads},
+	{"readHits", &readHits},
+	{"compul", &compul},
+	{"conflict", &conflict},
+	{"capacity", &capacity},
+	{"numReadsD", &numReadsD},
+	{"readHitsD", &readHitsD},
+	{"compulD", &compulD},
+	{"conflictD", &conflictD},
+	{"capacityD", &capacityD},
+	{"numWrites", &numWrites},
+	{"numWordsWritten", &numWordsWritten},
+	{"numWordsRead", &numWordsRead},
+	{"wHits", &wHits},
+	{"compulW", &compulW},
+	{"conflictW", &conflictW},
+	{"capacityW", &capacityW},
+	{"iPrefetchIssued", &iPrefetch.issued},
+	{"iPrefetchUseful", &iPrefetch.useful},
+	{"iPrefetchUseless", &iPrefetch.useless},
+	{"iPrefetchWordsRead", &iPrefetch.wordsRead},
+	{"dPrefetchIssued", &dPrefetch.issued},
+	{"dPrefetchUseful", &dPrefetch.useful},
+	{"dPrefetchUseless", &dPrefetch.useless},
+	{"dPrefetchWordsRead", &dPrefetch.wordsRead},
+	{"combineStores", &combineStores},
+	{"combineHits", &combineHits},
+	{"combineWords", &combineWords},
+	{"victimReadHits", &victimReadHits},
+	{"victimWriteHits", &victimWriteHits},
+	{"victimReadWords", &victimReadWords},
+	{"victimFetchWords", &victimFetchWords},
+	{"victimWritebacks", &victimWritebacks},
+};
+#define NUM_RESULT_COUNTERS ((int)(sizeof(resultCounters) / sizeof(resultCounters[0])))
+
+int forceRecompute;
+static unsigned long long resultKey;
+static char resultPath[1024];
+
+//FNV-1a, good enough for telling traces and configs apart.
+static unsigned long long hashBytes(unsigned long long h, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	for(size_t i = 0; i < len; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned long long hashInt(unsigned long long h, long long value)
+{
+	return hashBytes(h, &value, sizeof(value));
+}
+
+//Hash the fields that affect the simulation. The replacement scheme is ignored
+//for direct mapped caches, so leave it out there.
+static unsigned long long hashCacheInfo(unsigned long long h, CacheInfo info)
+{
+	h = hashInt(h, info.num_blocks);
+	h = hashInt(h, info.words_per_block);
+	h = hashInt(h, info.associativity);
+	h = hashInt(h, info.associativity > 1 ? (int)info.replacement : -1);
+	h = hashInt(h, info.write_scheme);
+	h = hashInt(h, info.allocate_scheme);
+	return h;
+}
+
+static unsigned long long hashPrefetcher(unsigned long long h, Prefetcher* pf)
+{
+	h = hashInt(h, pf->kind);
+	h = hashInt(h, pf->degree);
+	h = hashInt(h, pf->distance);
+	return h;
+}
+
+static unsigned long long hashTrace(unsigned long long h, FILE* trace)
+{
+	struct stat st;
+	char buf[RESULT_SAMPLE_SIZE];
+	if(fstat(fileno(trace), &st) != 0)
+		return 0;
+
+	h = hashInt(h, st.st_size);
+	h = hashInt(h, st.st_mtime);
+	//Sample evenly spaced chunks plus the tail of the file.
+	for(int i = 0; i <= RESULT_SAMPLES; i++)
+	{
+		long long offset = (long long)st.st_size * i / RESULT_SAMPLES;
+		if(i == RESULT_SAMPLES)
+			offset = st.st_size > RESULT_SAMPLE_SIZE ? st.st_size - RESULT_SAMPLE_SIZE : 0;
+		if(fseek(trace, offset, SEEK_SET) != 0)
+			return 0;
+		size_t got = fread(buf, 1, sizeof(buf), trace);
+		h = hashBytes(h, buf, got);
+	}
+	rewind(trace);
+	return h;
+}
+
+//Build the key and path for this run and try to load a stored result.
+//Returns 1 if the counters were filled in from the store.
+int loadResult(FILE* trace)
+{
+	const char* dir = getenv("CACHESIM_RESULTS");
+	if(dir == NULL || dir[0] == '\0')
+		dir = ".cachesim-results";
+
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	h = hashInt(h, RESULT_VERSION);
+	h = hashTrace(h, trace);
+	if(h == 0)
+		return 0;
+	h = hashCacheInfo(h, icache_info);
+	for(int i = 0; i < 3; i++)
+		h = hashCacheInfo(h, dcache_info[i]);
+	h = hashInt(h, iIndexing);
+	for(int i = 0; i < 3; i++)
+		h = hashInt(h, dIndexing[i]);
+	h = hashPrefetcher(h, &iPrefetch);
+	h = hashPrefetcher(h, &dPrefetch);
+	h = hashInt(h, combineEntries);
+	h = hashInt(h, victimEntries);
+	resultKey = h;
+	snprintf(resultPath, sizeof(resultPath), "%s/%016llx", dir, resultKey);
+
+	//The instrumentation dump needs the trace to actually be simulated.
+	if(forceRecompute || statsPath != NULL)
+		return 0;
+
+	FILE* f = fopen(resultPath, "r");
+	if(f == NULL)
+		return 0;
+
+	int version = 0;
+	unsigned long long key = 0;
+	int loaded = 0;
+	if(fscanf(f, "cachesim-result %d\nkey %llx\n", &version, &key) == 2 &&
+		version == RESULT_VERSION && key == resultKey)
+	{
+		char name[64];
+		int value;
+		while(fscanf(f, "%63s %d\n", name, &value) == 2)
+		{
+			for(int i = 0; i < NUM_RESULT_COUNTERS; i++)
+			{
+				if(strcmp(name, resultCounters[i].name) == 0)
+				{
+					*resultCounters[i].value = value;
+					loaded++;
+					break;
+				}
+			}
+		}
+	}
+	fclose(f);
+	return loaded == NUM_RESULT_COUNTERS;
+}
+
+//Store the counters for this run. Must be called before print_statistics()
+//since it adjusts some of them. Failing to save is not an error.
+void saveResult()
+{
+	if(resultKey == 0)
+		return;
+
+	char tmpPath[sizeof(resultPath) + 16];
+	char* slash = strrchr(resultPath, '/');
+	*slash = '\0';
+	mkdir(resultPath, 0755);
+	*slash = '/';
+
+	//Write to a temporary file first so a concurrent run never reads half a result.
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.tmp", resultPath, (long)getpid());
+	FILE* f = fopen(tmpPath, "w");
+	if(f == NULL)
+		return;
+	fprintf(f, "cachesim-result %d\nkey %016llx\n", RESULT_VERSION, resultKey);
+	for(int i = 0; i < NUM_RESULT_COUNTERS; i++)
+		fprintf(f, "%s %d\n", resultCounters[i].name, *resultCounters[i].value);
+	if(fclose(f) != 0 || rename(tmpPath, resultPath) != 0)
+		remove(tmpPath);
 }
 
 /*******************************************************************************
@@ -685,6 +2128,19 @@ static void bad_params(const char* msg)
 	exit(1);
 }
 
+static IndexScheme parse_indexing(char scheme, const char* msg)
+{
+	switch(scheme)
+	{
+		case 'M': return Index_MODULO;
+		case 'X': return Index_XOR;
+		case 'P': return Index_PRIME;
+		case 'S': return Index_SKEWED;
+		default: bad_params(msg);
+	}
+	return Index_MODULO;
+}
+
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
 FILE* parse_arguments(int argc, char** argv)
@@ -700,11 +2156,87 @@ FILE* parse_arguments(int argc, char** argv)
 	char write_scheme;
 	char alloc_scheme;
 	char replace_scheme;
+	char index_scheme;
+	char pf_cache;
+	char pf_kind;
+	int pf_degree;
+	int pf_distance;
+	Prefetcher* pf;
 	int converted;
 
 	for(i = 1; i < argc; i++)
 	{
-		if(streq(argv[i], "-I"))
+		if(streq(argv[i], "-F"))
+		{
+			forceRecompute = 1;
+		}
+		else if(streq(argv[i], "-S"))
+		{
+			sparseSets = 1;
+		}
+		else if(streq(argv[i], "-P"))
+		{
+			if(i == (argc - 1))
+				bad_params("Expected parameters after -P.");
+
+			i++;
+			converted = sscanf(argv[i], "%c:%c:%d:%d",
+				&pf_cache, &pf_kind, &pf_degree, &pf_distance);
+
+			if(converted < 4 || pf_degree < 1 || pf_distance < 1)
+				bad_params("Invalid prefetcher parameters.");
+
+			if(pf_cache == 'I')
+				pf = &iPrefetch;
+			else if(pf_cache == 'D')
+				pf = &dPrefetch;
+			else
+				bad_params("Invalid prefetcher cache.");
+
+			if(pf->kind != Prefetch_NONE)
+				bad_params("Duplicate prefetcher parameters.");
+
+			if(pf_kind == 'N')
+				pf->kind = Prefetch_NEXT_LINE;
+			else if(pf_kind == 'S')
+				pf->kind = Prefetch_STRIDE;
+			else if(pf_kind == 'B')
+				pf->kind = Prefetch_STREAM;
+			else
+				bad_params("Invalid prefetcher type.");
+
+			pf->degree = pf_degree;
+			pf->distance = pf_distance;
+		}
+		else if(streq(argv[i], "-W") || streq(argv[i], "-V"))
+		{
+			if(i == (argc - 1))
+				bad_params("Expected number of entries after -W or -V.");
+
+			int* entries = streq(argv[i], "-W") ? &combineEntries : &victimEntries;
+			i++;
+			if(sscanf(argv[i], "%d", entries) < 1 || *entries < 1 || *entries > 64)
+				bad_params("Invalid number of buffer entries.");
+		}
+		else if(streq(argv[i], "-H"))
+		{
+			if(i == (argc - 1))
+				bad_params("Expected filename after -H.");
+
+			i++;
+			statsPath = argv[i];
+		}
+		else if(streq(argv[i], "-B"))
+		{
+			if(i == (argc - 1))
+				bad_params("Expected window size after -B.");
+
+			i++;
+			if(sscanf(argv[i], "%d", &batchWindow) < 1 ||
+				batchWindow < 1 || batchWindow > MAX_BATCH_WINDOW)
+				bad_params("Invalid batch window size.");
+		}
+		else if(streq(argv[i], "-I"))
 		{
 			if(i == (argc - 1))
 				bad_params("Expected parameters after -I.");
@@ -714,15 +2246,22 @@ FILE* parse_arguments(int argc, char** argv)
 			have_inst = 1;
 
 			i++;
-			converted = sscanf(argv[i], "%d:%d:%d:%c",
+			converted = sscanf(argv[i], "%d:%d:%d:%c:%c",
 				&icache_info.num_blocks,
 				&icache_info.words_per_block,
 				&icache_info.associativity,
-				&replace_scheme);
+				&replace_scheme,
+				&index_scheme);
 
 			if(converted < 4)
 				bad_params("Invalid I-cache parameters.");
 
+			if(converted == 5)
+				iIndexing = parse_indexing(index_scheme, "Invalid I-cache index scheme.");
+
+			if(iIndexing == Index_SKEWED && icache_info.associativity < 2)
+				bad_params("Skewed I-cache needs associativity of 2 or more.");
+
 			if(icache_info.associativity > 1)
 			{
 				if(replace_scheme == 'R')
@@ -739,9 +2278,9 @@ FILE* parse_arguments(int argc, char** argv)
 				bad_params("Expected parameters after -D.");
 
 			i++;
-			converted = sscanf(argv[i], "%d:%d:%d:%d:%c:%c:%c",
+			converted = sscanf(argv[i], "%d:%d:%d:%d:%c:%c:%c:%c",
 				&level, &num_blocks, &words_per_block, &associativity,
-				&replace_scheme, &write_scheme, &alloc_scheme);
+				&replace_scheme, &write_scheme, &alloc_scheme, &index_scheme);
 
 			if(converted < 7)
 				bad_params("Invalid D-cache parameters.");
@@ -753,6 +2292,12 @@ FILE* parse_arguments(int argc, char** argv)
 			if(have_data[level])
 				bad_params("Duplicate D-cache level parameters.");
 
+			if(converted == 8)
+				dIndexing[level] = parse_indexing(index_scheme, "Invalid D-cache index scheme.");
+
+			if(dIndexing[level] == Index_SKEWED && associativity < 2)
+				bad_params("Skewed D-cache needs associativity of 2 or more.");
+
 			have_data[level] = 1;
 
 			dcache_info[level].num_blocks = num_blocks;
@@ -795,6 +2340,18 @@ FILE* parse_arguments(int argc, char** argv)
 	if(!have_inst)
 		bad_params("No I-cache parameters specified.");
 
+	if(dPrefetch.kind != Prefetch_NONE && !have_data[0])
+		bad_params("D-cache prefetcher specified, but no D-cache.");
+
+	if((combineEntries > 0 || victimEntries > 0) && !have_data[0])
+		bad_params("Write-combining buffer or victim cache specified, but no D-cache.");
+
+	if(combineEntries > 0 && dcache_info[0].write_scheme != Write_WRITE_THROUGH)
+		bad_params("Write-combining buffer needs a write-through L1 D-cache.");
+
+	if(combineEntries > 0 && dcache_info[0].words_per_block > 64)
+		bad_params("Write-combining buffer needs 64 or fewer words per block.");
+
 	if(have_data[1] && !have_data[0])
 		bad_params("L2 D-cache specified, but not L1.");
 
@@ -813,13 +2370,28 @@ int main(int argc, char** argv)
 {
 	FILE* trace = parse_arguments(argc, argv);
 
+	if(loadResult(trace))
+	{
+		fclose(trace);
+		dump_cache_info();
+		print_statistics();
+		return 0;
+	}
+
 	setup_caches();
 
-	while(!feof(trace))
-		read_trace_line(trace);
+	if(batchWindow > 0)
+		runBatched(trace);
+	else
+	{
+		while(!feof(trace))
+			read_trace_line(trace);
+	}
 
 	fclose(trace);
 
+	finishTrace();
+	saveResult();
 	print_statistics();
 	return 0;
 }
\ No newline at end of file